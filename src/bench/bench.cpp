@@ -0,0 +1,188 @@
+/**
+ * Microbenchmarks of the primitives used by the gateway for each event it
+ * relays.  Each one prints the time and the number of heap allocations
+ * per operation.
+ */
+
+#include <xmpp/vaporo_component.hpp>
+#include <steam/steam_client.hpp>
+#include <steam/frames.hpp>
+#include <network/poller.hpp>
+#include <xmpp/roster.hpp>
+#include <xmpp/jid.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+static std::size_t allocations = 0;
+
+void* operator new(std::size_t size)
+{
+  ++allocations;
+  if (void* ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+/**
+ * Prevent the compiler from optimizing away a computed value.
+ */
+template <typename T>
+static void keep(const T& value)
+{
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+/**
+ * Call f iterations times and print the mean cost of one call.
+ */
+template <typename F>
+static void run(const std::string& name, const std::size_t iterations, F&& f)
+{
+  const auto allocations_before = allocations;
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; ++i)
+    f(i);
+  const auto end = std::chrono::steady_clock::now();
+  const auto allocated = allocations - allocations_before;
+  const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  std::printf("%-40s %12.1f ns/op %10.2f allocs/op\n", name.data(),
+              ns / iterations, static_cast<double>(allocated) / iterations);
+}
+
+/**
+ * Like run(), but call setup before each call of f, outside of the measured
+ * time and allocations.
+ */
+template <typename Setup, typename F>
+static void run_with_setup(const std::string& name, const std::size_t iterations,
+                           Setup&& setup, F&& f)
+{
+  std::size_t allocated = 0;
+  std::chrono::steady_clock::duration elapsed{};
+  for (std::size_t i = 0; i < iterations; ++i)
+    {
+      setup(i);
+      const auto allocations_before = allocations;
+      const auto start = std::chrono::steady_clock::now();
+      f(i);
+      const auto end = std::chrono::steady_clock::now();
+      allocated += allocations - allocations_before;
+      elapsed += end - start;
+    }
+  const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+  std::printf("%-40s %12.1f ns/op %10.2f allocs/op\n", name.data(),
+              ns / iterations, static_cast<double>(allocated) / iterations);
+}
+
+static std::vector<std::string> make_ids(const std::size_t count)
+{
+  std::vector<std::string> ids;
+  ids.reserve(count);
+  for (std::size_t i = 0; i < count; ++i)
+    ids.push_back(steam_id_to_string(Steam::SteamID(76561197960265728ull + i)));
+  return ids;
+}
+
+static void bench_stanzas(VaporoComponent& component)
+{
+  const std::string id = steam_id_to_string(Steam::SteamID(76561197960265728ull));
+  run("make_presence", 100000, [&](std::size_t)
+      {
+        keep(component.make_presence(id, {}, {}, {}, "away"));
+      });
+  run("make_presence + to_string", 100000, [&](std::size_t)
+      {
+        keep(component.make_presence(id, {}, {}, {}, "away").to_string());
+      });
+  Roster roster;
+  const RosterItem* item = roster.add_item(id, "Gordon Freeman");
+  run("make_roster_push + to_string", 100000, [&](std::size_t)
+      {
+        keep(component.make_roster_push(item).to_string());
+      });
+}
+
+static void bench_ids(const std::string& hostname)
+{
+  run("steam_id_to_string", 1000000, [](std::size_t i)
+      {
+        keep(steam_id_to_string(Steam::SteamID(76561197960265728ull + i)));
+      });
+  const std::string jid = steam_id_to_string(Steam::SteamID(76561197960265728ull))
+    + "@" + hostname;
+  run("Jid + string_to_steam_id", 1000000, [&](std::size_t)
+      {
+        keep(string_to_steam_id(Jid(jid).local));
+      });
+}
+
+static void bench_roster(const std::size_t size)
+{
+  const auto ids = make_ids(size);
+  Roster roster;
+  run("Roster::add_item (" + std::to_string(size) + " items)", size,
+      [&](std::size_t i)
+      {
+        keep(roster.add_item(ids[i], "Name"));
+      });
+  const std::size_t lookups = size < 1000 ? 100000 : 1000;
+  run("Roster::get_item (" + std::to_string(size) + " items)", lookups,
+      [&](std::size_t i)
+      {
+        keep(roster.get_item(ids[(i * 7919) % size]));
+      });
+}
+
+static void bench_frames(const std::size_t frame_size)
+{
+  const std::size_t frames = 1000;
+  const std::string data(frame_size * frames, 'x');
+  std::string buf;
+  run_with_setup("consume_frames (" + std::to_string(frames) + " x "
+                 + std::to_string(frame_size) + " bytes)", 1000,
+      [&](std::size_t)
+      {
+        buf = data;
+      },
+      [&](std::size_t)
+      {
+        const auto wanted = consume_frames(buf, frame_size,
+                                           [frame_size](const unsigned char* frame)
+                                           {
+                                             keep(frame);
+                                             return frame_size;
+                                           });
+        keep(wanted);
+      });
+}
+
+int main()
+{
+  const std::string hostname("steam.example.com");
+  auto p = std::make_shared<Poller>();
+  VaporoComponent component(p, hostname, "secret", "user@example.com",
+                            "login", "password");
+
+  bench_stanzas(component);
+  bench_ids(hostname);
+  for (const std::size_t size: {10u, 1000u, 100000u})
+    bench_roster(size);
+  for (const std::size_t size: {16u, 1024u})
+    bench_frames(size);
+  return 0;
+}
@@ -4,6 +4,32 @@
 #include <utils/timed_events.hpp>
 #include <logger/logger.hpp>
 #include <config/config.hpp>
+#include <profiler/profiler.hpp>
+#include <metrics/metrics.hpp>
+
+#include <csignal>
+#include <stdexcept>
+
+/**
+ * Set by the SIGUSR2 handler, to export the profiler trace from the main
+ * loop.
+ */
+static volatile std::sig_atomic_t export_trace = 0;
+
+static void sigusr2_handler(int)
+{
+  export_trace = 1;
+}
+
+/**
+ * Set by the SIGUSR1 handler, to log the metrics from the main loop.
+ */
+static volatile std::sig_atomic_t log_metrics = 0;
+
+static void sigusr1_handler(int)
+{
+  log_metrics = 1;
+}
 
 /**
  * Provide an helpful message to help the user write a minimal working
@@ -20,8 +46,69 @@ int config_help(const std::string& missing_option)
   return 1;
 }
 
+/**
+ * Report an option whose value is present but invalid.
+ */
+static int config_invalid(const std::string& option)
+{
+  std::cerr << "Error: invalid value for option " << option << "." << std::endl;
+  return config_help("");
+}
+
+/**
+ * Parse an unsigned integer option, refusing anything else than digits,
+ * and values above max.
+ */
+static bool parse_unsigned(const std::string& str, const unsigned long max,
+                           unsigned long& value)
+{
+  if (str.empty() || str.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  try {
+    value = std::stoul(str);
+  }
+  catch (const std::out_of_range& e) {
+    return false;
+  }
+  return value <= max;
+}
+
+/**
+ * Enable the profiler if a slow callback threshold is configured, and
+ * export its trace each time we receive SIGUSR2.  Returns non-zero if the
+ * configuration is invalid.
+ */
+static int setup_profiler()
+{
+  const std::string threshold = Config::get("profiler_slow_threshold_ms", "");
+  if (threshold.empty())
+    return 0;
+  // One hour, and ten million events (a few hundreds of MB)
+  const unsigned long max_threshold_ms = 3600000;
+  const unsigned long max_max_events = 10000000;
+  unsigned long threshold_ms;
+  unsigned long max_events;
+  if (!parse_unsigned(threshold, max_threshold_ms, threshold_ms))
+    return config_invalid("profiler_slow_threshold_ms");
+  if (!parse_unsigned(Config::get("profiler_max_events", "100000"), max_max_events, max_events))
+    return config_invalid("profiler_max_events");
+  Profiler::instance().enable(std::chrono::milliseconds(threshold_ms),
+                              Config::get("profiler_trace_file", "vaporo-trace.json"),
+                              max_events);
+
+  struct sigaction on_sigusr2;
+  on_sigusr2.sa_handler = &sigusr2_handler;
+  sigemptyset(&on_sigusr2.sa_mask);
+  on_sigusr2.sa_flags = 0;
+  sigaction(SIGUSR2, &on_sigusr2, nullptr);
+  return 0;
+}
+
 int main(int ac, char** av)
 {
+  // Start counting the time for the metrics timings
+  Metrics::instance();
+
   if (ac > 1)
     Config::filename = av[1];
   else
@@ -52,17 +139,65 @@ int main(int ac, char** av)
   if (authorized_jid.empty())
     return config_help("authorized_jid");
 
+  if (setup_profiler() != 0)
+    return 1;
+
+  struct sigaction on_sigusr1;
+  on_sigusr1.sa_handler = &sigusr1_handler;
+  sigemptyset(&on_sigusr1.sa_mask);
+  on_sigusr1.sa_flags = 0;
+  sigaction(SIGUSR1, &on_sigusr1, nullptr);
+
   auto p = std::make_shared<Poller>();
 
   auto xmpp_component =
       std::make_shared<VaporoComponent>(p, hostname, password,
                                         authorized_jid, login, steam_pass);
   xmpp_component->start();
+  // Connect and log in to steam in parallel with the component handshake,
+  // so that the session is ready when the user's presence arrives
+  if (Config::get("steam_eager_login", "false") == "true")
+    xmpp_component->start_steam();
 
   auto timeout = TimedEventsManager::instance().get_timeout();
-  while (p->poll(timeout) != -1)
+  while (true)
     {
-      TimedEventsManager::instance().execute_expired_events();
+      // When profiling, wait for the sockets to become readable before
+      // calling poll(), so that the idle time is not counted as time spent
+      // in the socket handlers (reading, XML parsing, dispatching, writing)
+      bool waited = false;
+      if (Profiler::instance().is_enabled())
+        {
+          ProfilerScope scope("idle", false);
+          waited = xmpp_component->wait_for_input(timeout);
+        }
+      if (waited)
+        timeout = decltype(timeout)::zero();
+      {
+        // If we could not wait before, this also includes the idle time,
+        // so it's not reported as slow
+        ProfilerScope scope(waited ? "Poller::poll" : "Poller::poll (with idle time)", waited);
+        if (p->poll(timeout) == -1)
+          break;
+      }
+      {
+        ProfilerScope scope("TimedEventsManager::execute_expired_events");
+        TimedEventsManager::instance().execute_expired_events();
+      }
+      {
+        ProfilerScope scope("VaporoComponent::flush");
+        xmpp_component->flush();
+      }
+      if (export_trace)
+        {
+          export_trace = 0;
+          Profiler::instance().export_trace();
+        }
+      if (log_metrics)
+        {
+          log_metrics = 0;
+          Metrics::instance().log();
+        }
       timeout = TimedEventsManager::instance().get_timeout();
     }
   return 0;
@@ -0,0 +1,46 @@
+#include <metrics/metrics.hpp>
+#include <logger/logger.hpp>
+
+Metrics& Metrics::instance()
+{
+  static Metrics metrics;
+  return metrics;
+}
+
+Metrics::Metrics():
+  start(std::chrono::steady_clock::now()),
+  values{}
+{
+}
+
+void Metrics::set(const std::string& name, const std::uint64_t value)
+{
+  this->values[name] = value;
+}
+
+void Metrics::add(const std::string& name, const std::uint64_t value)
+{
+  this->values[name] += value;
+}
+
+std::uint64_t Metrics::get(const std::string& name) const
+{
+  const auto it = this->values.find(name);
+  if (it == this->values.end())
+    return 0;
+  return it->second;
+}
+
+void Metrics::mark_time(const std::string& name)
+{
+  if (this->values.find(name) != this->values.end())
+    return;
+  const auto elapsed = std::chrono::steady_clock::now() - this->start;
+  this->values[name] = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+}
+
+void Metrics::log() const
+{
+  for (const auto& pair: this->values)
+    log_info("Metric " << pair.first << ": " << pair.second);
+}
@@ -0,0 +1,41 @@
+#ifndef METRICS_HPP_INCLUDED
+#define METRICS_HPP_INCLUDED
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+
+/**
+ * A set of named counters and timings describing how the gateway behaves,
+ * written in the log when asked (see main.cpp).
+ */
+class Metrics
+{
+public:
+  static Metrics& instance();
+  ~Metrics() = default;
+
+  void set(const std::string& name, const std::uint64_t value);
+  void add(const std::string& name, const std::uint64_t value);
+  std::uint64_t get(const std::string& name) const;
+  /**
+   * Set the value to the number of milliseconds elapsed since the start of
+   * the process, unless it has already been set.
+   */
+  void mark_time(const std::string& name);
+  void log() const;
+
+private:
+  Metrics();
+
+  const std::chrono::steady_clock::time_point start;
+  std::map<std::string, std::uint64_t> values;
+
+  Metrics(const Metrics&) = delete;
+  Metrics(Metrics&&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+  Metrics& operator=(Metrics&&) = delete;
+};
+
+#endif /* METRICS_HPP_INCLUDED */
@@ -0,0 +1,75 @@
+#include <profiler/profiler.hpp>
+#include <logger/logger.hpp>
+
+#include <fstream>
+
+Profiler& Profiler::instance()
+{
+  static Profiler profiler;
+  return profiler;
+}
+
+Profiler::Profiler():
+  enabled(false),
+  slow_threshold(0),
+  trace_filename{},
+  origin(clock::now()),
+  events{},
+  max_events(0),
+  next_event(0)
+{
+}
+
+void Profiler::enable(const std::chrono::microseconds& slow_threshold,
+                      const std::string& trace_filename,
+                      const std::size_t max_events)
+{
+  this->slow_threshold = slow_threshold;
+  this->trace_filename = trace_filename;
+  this->max_events = max_events;
+  this->events.clear();
+  this->events.reserve(max_events);
+  this->next_event = 0;
+  this->enabled = max_events > 0;
+}
+
+void Profiler::record(const char* name, const clock::time_point& start,
+                      const clock::time_point& end, const bool check_slow)
+{
+  const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+  if (check_slow && duration > this->slow_threshold)
+    log_warning("Slow callback: " << name << " took " << duration.count() << "us");
+
+  Event event{name,
+      std::chrono::duration_cast<std::chrono::microseconds>(start - this->origin),
+      duration};
+  if (this->events.size() < this->max_events)
+    this->events.push_back(event);
+  else
+    this->events[this->next_event] = event;
+  this->next_event = (this->next_event + 1) % this->max_events;
+}
+
+void Profiler::export_trace() const
+{
+  std::ofstream file(this->trace_filename);
+  if (!file.good())
+    {
+      log_error("Could not open trace file " << this->trace_filename);
+      return;
+    }
+  file << "{\"traceEvents\":[";
+  // Oldest events first: once the buffer is full, they start at next_event
+  const std::size_t first = this->events.size() < this->max_events ? 0 : this->next_event;
+  for (std::size_t i = 0; i < this->events.size(); ++i)
+    {
+      const Event& event = this->events[(first + i) % this->events.size()];
+      if (i != 0)
+        file << ",";
+      file << "\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1"
+           << ",\"ts\":" << event.start.count()
+           << ",\"dur\":" << event.duration.count() << "}";
+    }
+  file << "\n]}\n";
+  log_info("Exported " << this->events.size() << " events to " << this->trace_filename);
+}
@@ -0,0 +1,106 @@
+#ifndef PROFILER_HPP_INCLUDED
+#define PROFILER_HPP_INCLUDED
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * Records the duration of the callbacks run by the event loop, logs the
+ * ones that are slower than a threshold, and exports them as a Chrome
+ * trace-event JSON file (to be opened in chrome://tracing).
+ *
+ * It is disabled by default, and costs almost nothing in that case.
+ */
+class Profiler
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  static Profiler& instance();
+  ~Profiler() = default;
+
+  /**
+   * Start recording events.  Only the last max_events events are kept.
+   */
+  void enable(const std::chrono::microseconds& slow_threshold,
+              const std::string& trace_filename,
+              const std::size_t max_events);
+  bool is_enabled() const
+  {
+    return this->enabled;
+  }
+  /**
+   * Record one callback.  If check_slow is true and its duration is above
+   * the threshold, a warning is logged.
+   */
+  void record(const char* name, const clock::time_point& start,
+              const clock::time_point& end, const bool check_slow);
+  /**
+   * Write all the recorded events in the trace file.
+   */
+  void export_trace() const;
+
+private:
+  struct Event
+  {
+    const char* name;
+    std::chrono::microseconds start;
+    std::chrono::microseconds duration;
+  };
+
+  Profiler();
+
+  bool enabled;
+  std::chrono::microseconds slow_threshold;
+  std::string trace_filename;
+  const clock::time_point origin;
+  /**
+   * A ring buffer of the recorded events, next_event is the index where the
+   * next one will be written.
+   */
+  std::vector<Event> events;
+  std::size_t max_events;
+  std::size_t next_event;
+
+  Profiler(const Profiler&) = delete;
+  Profiler(Profiler&&) = delete;
+  Profiler& operator=(const Profiler&) = delete;
+  Profiler& operator=(Profiler&&) = delete;
+};
+
+/**
+ * Records the time spent between its construction and its destruction,
+ * if the profiler is enabled.  The name must be a string literal.
+ */
+class ProfilerScope
+{
+public:
+  explicit ProfilerScope(const char* name, const bool check_slow=true):
+    name(name),
+    check_slow(check_slow),
+    enabled(Profiler::instance().is_enabled())
+  {
+    if (this->enabled)
+      this->start = Profiler::clock::now();
+  }
+  ~ProfilerScope()
+  {
+    if (this->enabled)
+      Profiler::instance().record(this->name, this->start,
+                                  Profiler::clock::now(), this->check_slow);
+  }
+
+private:
+  const char* name;
+  const bool check_slow;
+  const bool enabled;
+  Profiler::clock::time_point start;
+
+  ProfilerScope(const ProfilerScope&) = delete;
+  ProfilerScope(ProfilerScope&&) = delete;
+  ProfilerScope& operator=(const ProfilerScope&) = delete;
+  ProfilerScope& operator=(ProfilerScope&&) = delete;
+};
+
+#endif /* PROFILER_HPP_INCLUDED */
@@ -0,0 +1,33 @@
+#ifndef STEAM_FRAMES_HPP_INCLUDED
+#define STEAM_FRAMES_HPP_INCLUDED
+
+#include <algorithm>
+#include <string>
+
+/**
+ * Feed every complete frame found at the start of buf to read_frame, which
+ * returns the size of the next frame it wants.  The consumed data is
+ * removed from buf, in one go, and the size wanted for the next (still
+ * incomplete) frame is returned.
+ *
+ * Each frame is copied out of buf (in a buffer reused for all of them)
+ * before read_frame is called, so read_frame may modify buf.
+ */
+template <typename ReadFrame>
+std::size_t consume_frames(std::string& buf, std::size_t wanted_size,
+                           ReadFrame&& read_frame)
+{
+  std::string frame;
+  std::size_t pos = 0;
+  // If read_frame shrinks buf, pos may end up past its end
+  while (pos <= buf.size() && buf.size() - pos >= wanted_size)
+    {
+      frame.assign(buf, pos, wanted_size);
+      pos += wanted_size;
+      wanted_size = read_frame(reinterpret_cast<const unsigned char*>(frame.data()));
+    }
+  buf.erase(0, std::min(pos, buf.size()));
+  return wanted_size;
+}
+
+#endif /* STEAM_FRAMES_HPP_INCLUDED */
@@ -1,11 +1,17 @@
 #include <steam/steam_client.hpp>
+#include <steam/frames.hpp>
+#include <profiler/profiler.hpp>
+#include <metrics/metrics.hpp>
 #include <logger/logger.hpp>
 #include <network/poller.hpp>
 #include <utils/timed_events.hpp>
 #include <xmpp/vaporo_component.hpp>
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <functional>
+#include <vector>
 #include <fstream>
 
 using namespace std::string_literals;
@@ -69,6 +75,19 @@ static const char* error_messages[] = {
   "unknown error",
 };
 
+/**
+ * Return the id of the chat room of a steam group: the same account with
+ * the Chat type (8) and the Clan chat instance flag.
+ */
+static const std::uint64_t account_type_mask = 0xFull << 52;
+static const std::uint64_t chat_account_type = 8ull << 52;
+
+static Steam::SteamID clan_to_chat_id(const Steam::SteamID& clan)
+{
+  const std::uint64_t clan_instance_flag = 0x80000ull << 32;
+  return Steam::SteamID((clan.steamID64 & ~account_type_mask) | chat_account_type | clan_instance_flag);
+}
+
 static const char* steam_state_to_xmpp_show[] = {
   // See EPersonaState
   "",
@@ -87,6 +106,12 @@ SteamClient::SteamClient(std::shared_ptr<Poller> poller,
   login(login),
   password(password),
   sentry{},
+  started(false),
+  logged_in(false),
+  login_error{},
+  close_after_read(false),
+  chat_rooms{},
+  steam_id{},
   xmpp(nullptr)
 {
   this->load_sentry();
@@ -105,6 +130,7 @@ SteamClient::SteamClient(std::shared_ptr<Poller> poller,
        TimedEvent keepalive(std::chrono::seconds(timeout),
                   [callback]()
                   {
+                    ProfilerScope scope("SteamClient interval callback");
                     log_debug("Calling the interval callback stuff");
                     callback();
                   });
@@ -125,13 +151,40 @@ SteamClient::SteamClient(std::shared_ptr<Poller> poller,
                                       std::placeholders::_5, std::placeholders::_6);
   this->steam->onPrivateMsg = std::bind(&SteamClient::on_private_msg, this,
                                         std::placeholders::_1, std::placeholders::_2);
+  this->steam->onChatEnter = std::bind(&SteamClient::on_chat_enter, this,
+                                       std::placeholders::_1, std::placeholders::_2,
+                                       std::placeholders::_3, std::placeholders::_4,
+                                       std::placeholders::_5);
+  this->steam->onChatMsg = std::bind(&SteamClient::on_chat_msg, this,
+                                     std::placeholders::_1, std::placeholders::_2,
+                                     std::placeholders::_3);
+  this->steam->onChatStateChange = std::bind(&SteamClient::on_chat_state_change, this,
+                                             std::placeholders::_1, std::placeholders::_2,
+                                             std::placeholders::_3, std::placeholders::_4,
+                                             std::placeholders::_5);
 }
 
 void SteamClient::start()
 {
+  if (this->started)
+    return;
+  this->started = true;
   this->connect("72.165.61.174", "27017", false);
 }
 
+void SteamClient::send_current_state()
+{
+  this->xmpp->send_presence({}, {}, {}, {}, {});
+  std::vector<Steam::SteamID> ids;
+  for (const auto& item: this->roster.get_items())
+    ids.push_back(string_to_steam_id(item.jid));
+  log_debug("Requesting user info for " << ids.size() << " friends");
+  if (!ids.empty())
+    this->steam->RequestUserInfo(ids.size(), ids.data());
+  if (!this->chat_rooms.empty())
+    this->xmpp->send_chat_rooms_list(this->chat_rooms);
+}
+
 void SteamClient::on_connected()
 {
   log_debug("We are connected, calling steam->connected()");
@@ -142,31 +195,39 @@ void SteamClient::on_connected()
 void SteamClient::on_connection_failed(const std::string& reason)
 {
   log_debug("Connection failed: " << reason);
+  this->started = false;
 }
 
 void SteamClient::on_connection_close(const std::string& error)
 {
   log_debug("Connection closed: " << error);
+  this->started = false;
+  this->logged_in = false;
+  this->xmpp->on_steam_disconnected();
 }
 
 void SteamClient::parse_in_buffer(const size_t size)
 {
+  ProfilerScope scope("SteamClient::parse_in_buffer");
   log_debug("Data received: " << size);
   log_debug("We have: " << this->in_buf.size() << " and steam wants " << this->wanted_size);
-  if (this->in_buf.size() >= this->wanted_size)
+  this->wanted_size = consume_frames(this->in_buf, this->wanted_size,
+                                     [this](const unsigned char* frame)
+                                     {
+                                       return this->steam->readable(frame);
+                                     });
+  log_debug("New wanted_size: " << this->wanted_size);
+  if (this->close_after_read)
     {
-      // Maybe do not get the to_send, just use the whole in_buf
-      auto to_send = this->in_buf.substr(0, this->wanted_size);
-      this->in_buf = this->in_buf.substr(this->wanted_size);
-      this->wanted_size = this->steam->readable(reinterpret_cast<const unsigned char*>(to_send.data()));
-      log_debug("New wanted_size: " << this->wanted_size);
-      if (this->in_buf.size() >= this->wanted_size)
-        this->parse_in_buffer(0);
+      this->close_after_read = false;
+      this->close();
+      this->started = false;
     }
 }
 
 void SteamClient::on_handshake()
 {
+  ProfilerScope scope("SteamClient::on_handshake");
   log_debug("onHandshake");
   if (this->sentry[0] != '\0')
     {
@@ -183,23 +244,46 @@ void SteamClient::on_handshake()
 
 void SteamClient::on_log_on(Steam::EResult result, Steam::SteamID steam_id)
 {
+  ProfilerScope scope("SteamClient::on_log_on");
   log_debug("on_log_on: " << static_cast<std::size_t>(result) << " steamid: " << steam_id.steamID64);
   if (result == Steam::EResult::OK)
     {
+      Metrics::instance().mark_time("steam_logged_in_ms");
+      this->logged_in = true;
+      this->steam_id = steam_id;
       // TODO: handle busy, away, etc
       this->roster.clear();
       this->steam->SetPersonaState(Steam::EPersonaState::Online);
-      this->xmpp->send_presence({}, {}, {}, {}, {});
+      // If we logged in before the user became available, this will be
+      // sent by send_current_state() instead
+      if (this->xmpp->is_user_available())
+        this->xmpp->send_presence({}, {}, {}, {}, {});
     }
   else
     {
-      this->xmpp->send_presence({}, "unavailable", {}, {}, {});
-      this->xmpp->send_information_message("Login failed: "s + error_messages[static_cast<std::size_t>(result)]);
+      this->login_error = "Login failed: "s + error_messages[static_cast<std::size_t>(result)];
+      log_error(this->login_error);
+      // Close the connection, so that the next start() tries again.  Not
+      // right now, we are inside steam->readable(), called by
+      // parse_in_buffer()
+      this->close_after_read = true;
+      if (this->xmpp->is_user_available())
+        this->send_login_error();
     }
 }
 
+void SteamClient::send_login_error()
+{
+  if (this->login_error.empty())
+    return;
+  this->xmpp->send_presence({}, "unavailable", {}, {}, {});
+  this->xmpp->send_information_message(this->login_error);
+  this->login_error.clear();
+}
+
 void SteamClient::on_sentry(const unsigned char* hash)
 {
+  ProfilerScope scope("SteamClient::on_sentry");
   log_debug("on_sentry");
   ::memcpy(this->sentry, hash, 20);
   log_debug("Sentry: " << std::string(reinterpret_cast<const char*>(hash), 20));
@@ -210,6 +294,7 @@ void SteamClient::on_relationships(bool incremental,
                                    std::map<Steam::SteamID, Steam::EFriendRelationship>& users,
                                    std::map<Steam::SteamID, Steam::EClanRelationship>& groups)
 {
+  ProfilerScope scope("SteamClient::on_relationships");
   log_debug("on_relationships: " << incremental);
 
   Steam::SteamID users_info[users.size()];
@@ -225,22 +310,31 @@ void SteamClient::on_relationships(bool incremental,
   log_debug("Requesting user info for " << i << " friends");
   this->steam->RequestUserInfo(i, users_info);
 
-  return ;
-  // TODO, or remove
   log_debug("-- Groups --");
+  if (!incremental)
+    this->chat_rooms.clear();
   for (auto it = groups.begin(); it != groups.end(); ++it)
     {
       const Steam::SteamID& id = it->first;
       const Steam::EClanRelationship& relationship = it->second;
       log_debug("SteamID: " << id.steamID64 << " with type " << static_cast<int>(relationship));
+      const std::string room_id = steam_id_to_string(clan_to_chat_id(id));
+      auto room = std::find(this->chat_rooms.begin(), this->chat_rooms.end(), room_id);
+      if (relationship == Steam::EClanRelationship::Member && room == this->chat_rooms.end())
+        this->chat_rooms.push_back(room_id);
+      else if (relationship != Steam::EClanRelationship::Member && room != this->chat_rooms.end())
+        this->chat_rooms.erase(room);
     }
+  if (!groups.empty() && !this->chat_rooms.empty() && this->xmpp->is_user_available())
+    this->xmpp->send_chat_rooms_list(this->chat_rooms);
 }
 
 void SteamClient::on_user_info(Steam::SteamID user, Steam::SteamID* source, const char* name,
                                Steam::EPersonaState* state, const unsigned char avatar_hash[20],
                                const char* game_name)
 {
-  const std::string id(std::to_string(user.steamID64));
+  ProfilerScope scope("SteamClient::on_user_info");
+  const std::string id = steam_id_to_string(user);
   auto item = this->roster.get_item(id);
   if (!item)
     {
@@ -257,6 +351,9 @@ void SteamClient::on_user_info(Steam::SteamID user, Steam::SteamID* source, cons
     }
   log_debug("on_user_info: " << name << ": " << user.steamID64);
 
+  if (!this->xmpp->is_user_available())
+    return;
+
   this->xmpp->on_steam_roster_item_changed(item);
 
   if (!state || *state == Steam::EPersonaState::Offline)
@@ -273,11 +370,101 @@ void SteamClient::on_user_info(Steam::SteamID user, Steam::SteamID* source, cons
 
 void SteamClient::on_private_msg(Steam::SteamID user, const char* message)
 {
+  ProfilerScope scope("SteamClient::on_private_msg");
   log_debug("on_private_msg: " << user.steamID64 << " [" << message << "]");
-  const std::string id = std::to_string(user.steamID64);
+  const std::string id = steam_id_to_string(user);
+  // If the component handshake is not done yet, this stays in the queue
+  // until it is
   this->xmpp->send_message_from_steam(id, message);
 }
 
+void SteamClient::on_chat_enter(Steam::SteamID room, Steam::EChatRoomEnterResponse response,
+                                const char* name, std::size_t member_count,
+                                const Steam::ChatMember members[])
+{
+  ProfilerScope scope("SteamClient::on_chat_enter");
+  log_debug("on_chat_enter: " << room.steamID64 << " (" << (name ? name : "") << "): "
+            << static_cast<int>(response) << ", " << member_count << " members");
+  const std::string room_id = steam_id_to_string(room);
+  if (response != Steam::EChatRoomEnterResponse::Success)
+    {
+      this->xmpp->on_steam_chat_enter_failed(room_id);
+      return;
+    }
+  std::vector<Occupant> occupants;
+  occupants.reserve(member_count);
+  for (std::size_t i = 0; i < member_count; ++i)
+    if (members[i].steamID.steamID64 != this->steam_id.steamID64)
+      occupants.push_back({members[i].steamID.steamID64, this->get_nick(members[i].steamID)});
+  this->xmpp->on_steam_chat_entered(room_id, std::move(occupants));
+}
+
+void SteamClient::on_chat_msg(Steam::SteamID room, Steam::SteamID chatter, const char* message)
+{
+  ProfilerScope scope("SteamClient::on_chat_msg");
+  log_debug("on_chat_msg: " << room.steamID64 << " " << chatter.steamID64 << " [" << message << "]");
+  this->xmpp->send_muc_message_from_steam(steam_id_to_string(room), chatter.steamID64, message);
+}
+
+void SteamClient::on_chat_state_change(Steam::SteamID room, Steam::SteamID acted_by,
+                                       Steam::SteamID acted_on,
+                                       Steam::EChatMemberStateChange state_change,
+                                       const unsigned char member_info[])
+{
+  ProfilerScope scope("SteamClient::on_chat_state_change");
+  log_debug("on_chat_state_change: " << room.steamID64 << " " << acted_on.steamID64
+            << " " << static_cast<int>(state_change));
+  // The state change is a set of flags
+  const auto change = static_cast<int>(state_change);
+  const auto left = static_cast<int>(Steam::EChatMemberStateChange::Left) |
+    static_cast<int>(Steam::EChatMemberStateChange::Disconnected) |
+    static_cast<int>(Steam::EChatMemberStateChange::Kicked) |
+    static_cast<int>(Steam::EChatMemberStateChange::Banned);
+  const std::string room_id = steam_id_to_string(room);
+  if (acted_on.steamID64 == this->steam_id.steamID64)
+    {
+      if (!(change & left))
+        return;
+      // 301 and 307 are the MUC status codes for a ban and a kick
+      std::string status_code;
+      if (change & static_cast<int>(Steam::EChatMemberStateChange::Banned))
+        status_code = "301";
+      else if (change & static_cast<int>(Steam::EChatMemberStateChange::Kicked))
+        status_code = "307";
+      this->xmpp->on_steam_chat_removed(room_id, status_code);
+    }
+  else if (change & static_cast<int>(Steam::EChatMemberStateChange::Entered))
+    this->xmpp->on_steam_chat_occupant_joined(room_id, acted_on.steamID64,
+                                              this->get_nick(acted_on));
+  else if (change & left)
+    this->xmpp->on_steam_chat_occupant_left(room_id, acted_on.steamID64);
+}
+
+void SteamClient::join_chat(const std::string& room_id)
+{
+  this->steam->JoinChat(string_to_steam_id(room_id));
+}
+
+void SteamClient::leave_chat(const std::string& room_id)
+{
+  this->steam->LeaveChat(string_to_steam_id(room_id));
+}
+
+void SteamClient::send_chat_message(const std::string& room_id, const std::string& body)
+{
+  this->steam->SendChatMessage(string_to_steam_id(room_id), body.data());
+  Metrics::instance().mark_time("first_message_relayed_ms");
+}
+
+std::string SteamClient::get_nick(const Steam::SteamID& id)
+{
+  const std::string str_id = steam_id_to_string(id);
+  const auto item = this->roster.get_item(str_id);
+  if (item && !item->name.empty())
+    return item->name;
+  return str_id;
+}
+
 void SteamClient::save_sentry()
 {
   std::ofstream sentry_file("./sentry.bin", std::ios::binary);
@@ -300,7 +487,27 @@ void SteamClient::load_sentry()
 
 void SteamClient::send_message(const std::string& str_id, const std::string& body)
 {
-  Steam::SteamID id(std::stoll(str_id));
+  const Steam::SteamID id = string_to_steam_id(str_id);
   log_debug("sending steam message: " << id << " == " << id.steamID64 << " body: " << body);
   this->steam->SendPrivateMessage(id, body.data());
+  Metrics::instance().mark_time("first_message_relayed_ms");
+}
+
+std::string steam_id_to_string(const Steam::SteamID& id)
+{
+  return std::to_string(id.steamID64);
+}
+
+Steam::SteamID string_to_steam_id(const std::string& str)
+{
+  return Steam::SteamID(std::stoll(str));
+}
+
+bool is_chat_room_id(const std::string& str)
+{
+  if (str.empty() || str.size() > 20 ||
+      str.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  const std::uint64_t id = std::strtoull(str.data(), nullptr, 10);
+  return (id & account_type_mask) == chat_account_type;
 }
@@ -7,10 +7,23 @@
 #include <steam++.h>
 
 #include <memory>
+#include <vector>
 
 class Poller;
 class VaporoComponent;
 
+/**
+ * Convert a SteamID into the string used as the local part of the JID of
+ * that contact, and back.
+ */
+std::string steam_id_to_string(const Steam::SteamID& id);
+Steam::SteamID string_to_steam_id(const std::string& str);
+/**
+ * Whether the string is the id of a steam chat room.  Never throws, unlike
+ * string_to_steam_id().
+ */
+bool is_chat_room_id(const std::string& str);
+
 class SteamClient: public TCPSocketHandler
 {
   using SteamPPClient = Steam::SteamClient;
@@ -24,13 +37,50 @@ public:
     this->xmpp = xmpp;
   }
 
+  /**
+   * Connect and log in to steam, unless it's already done or in progress.
+   */
   void start();
+  bool is_logged_in() const
+  {
+    return this->logged_in;
+  }
+  /**
+   * Whether the only event this socket can be waiting for is incoming data
+   * (it is connected and has nothing to write), or it's not used at all.
+   */
+  bool only_waits_for_input() const
+  {
+    return !this->started || (this->is_connected() && this->out_buf.empty());
+  }
+  bool is_started() const
+  {
+    return this->started;
+  }
+  /**
+   * Send our presence, the presence of each steam contact and the list of
+   * chat rooms to the XMPP user.  Used when the user becomes available
+   * after we logged in.
+   */
+  void send_current_state();
+  /**
+   * If the last login failed, tell the user about it.  The failure is kept
+   * until the user is available to receive it.
+   */
+  void send_login_error();
 
   void on_connected() override final;
   void on_connection_failed(const std::string& reason) override final;
   void on_connection_close(const std::string& error) override final;
   void parse_in_buffer(const size_t size) override final;
   void send_message(const std::string& id, const std::string& body);
+  /**
+   * Enter, leave or talk in a chat room.  The id is the one of the chat
+   * room, not the one of the group it belongs to.
+   */
+  void join_chat(const std::string& room_id);
+  void leave_chat(const std::string& room_id);
+  void send_chat_message(const std::string& room_id, const std::string& body);
 
   /**
    * Callback called by the steam object on some events
@@ -47,8 +97,22 @@ public:
                     Steam::EPersonaState* state, const unsigned char avatar_hash[20],
                     const char* game_name);
   void on_private_msg(Steam::SteamID user, const char* message);
+  void on_chat_enter(Steam::SteamID room, Steam::EChatRoomEnterResponse response,
+                     const char* name, std::size_t member_count,
+                     const Steam::ChatMember members[]);
+  void on_chat_msg(Steam::SteamID room, Steam::SteamID chatter, const char* message);
+  void on_chat_state_change(Steam::SteamID room, Steam::SteamID acted_by,
+                            Steam::SteamID acted_on,
+                            Steam::EChatMemberStateChange state_change,
+                            const unsigned char member_info[]);
 
 private:
+  /**
+   * The nick of a steam user in the chat rooms: its name if it's one of
+   * our friends, its id otherwise.
+   */
+  std::string get_nick(const Steam::SteamID& id);
+
   std::unique_ptr<SteamPPClient> steam;
   const std::string login;
   const std::string password;
@@ -57,6 +121,29 @@ private:
    */
   std::size_t wanted_size;
   unsigned char sentry[20];
+  /**
+   * Whether start() has been called, and the connection has not been
+   * closed since then.
+   */
+  bool started;
+  bool logged_in;
+  /**
+   * The error of the last failed login, not yet sent to the user
+   */
+  std::string login_error;
+  /**
+   * Set by the steam callbacks to close the connection once
+   * parse_in_buffer() is done with the received data
+   */
+  bool close_after_read;
+  /**
+   * The ids of the chat rooms of the steam groups we are member of
+   */
+  std::vector<std::string> chat_rooms;
+  /**
+   * Our own id, known once we are logged in
+   */
+  Steam::SteamID steam_id;
   VaporoComponent* xmpp;
   Roster roster;
 
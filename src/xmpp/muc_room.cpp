@@ -0,0 +1,62 @@
+#include <xmpp/muc_room.hpp>
+
+#include <algorithm>
+
+static bool occupant_less(const Occupant& occupant, const std::uint64_t id)
+{
+  return occupant.id < id;
+}
+
+MucRoom::MucRoom(const std::string& nick):
+  nick(nick),
+  resources{},
+  joined(false),
+  occupants{}
+{
+}
+
+bool MucRoom::add_occupant(const std::uint64_t id, const std::string& nick)
+{
+  auto it = std::lower_bound(this->occupants.begin(), this->occupants.end(),
+                             id, &occupant_less);
+  if (it != this->occupants.end() && it->id == id)
+    return false;
+  this->occupants.insert(it, Occupant{id, nick});
+  return true;
+}
+
+std::string MucRoom::remove_occupant(const std::uint64_t id)
+{
+  auto it = std::lower_bound(this->occupants.begin(), this->occupants.end(),
+                             id, &occupant_less);
+  if (it == this->occupants.end() || it->id != id)
+    return {};
+  std::string nick = std::move(it->nick);
+  this->occupants.erase(it);
+  return nick;
+}
+
+const Occupant* MucRoom::find_occupant(const std::uint64_t id) const
+{
+  auto it = std::lower_bound(this->occupants.begin(), this->occupants.end(),
+                             id, &occupant_less);
+  if (it == this->occupants.end() || it->id != id)
+    return nullptr;
+  return &*it;
+}
+
+void MucRoom::set_occupants(std::vector<Occupant>&& occupants)
+{
+  this->occupants = std::move(occupants);
+  std::sort(this->occupants.begin(), this->occupants.end(),
+            [](const Occupant& a, const Occupant& b)
+            {
+              return a.id < b.id;
+            });
+}
+
+void MucRoom::clear_occupants()
+{
+  this->occupants.clear();
+  this->occupants.shrink_to_fit();
+}
@@ -0,0 +1,70 @@
+#ifndef MUC_ROOM_HPP_INCLUDED
+#define MUC_ROOM_HPP_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A steam user present in a chat room.
+ */
+struct Occupant
+{
+  std::uint64_t id;
+  std::string nick;
+};
+
+/**
+ * A steam chat room, as seen by the XMPP user.  The occupants are kept in a
+ * vector sorted by steam id, which stays small and cheap to search even
+ * for the big rooms.
+ */
+class MucRoom
+{
+public:
+  explicit MucRoom(const std::string& nick);
+  ~MucRoom() = default;
+  MucRoom(MucRoom&&) = default;
+
+  /**
+   * Returns false if that occupant was already present.
+   */
+  bool add_occupant(const std::uint64_t id, const std::string& nick);
+  /**
+   * Remove the occupant and return its nick, or an empty string if it was
+   * not present.
+   */
+  std::string remove_occupant(const std::uint64_t id);
+  const Occupant* find_occupant(const std::uint64_t id) const;
+  const std::vector<Occupant>& get_occupants() const
+  {
+    return this->occupants;
+  }
+  /**
+   * Replace all the occupants at once, cheaper than adding them one by one
+   */
+  void set_occupants(std::vector<Occupant>&& occupants);
+  void clear_occupants();
+
+  /**
+   * Our nick in the room
+   */
+  const std::string nick;
+  /**
+   * The full JIDs of the resources of the user that joined the room
+   */
+  std::vector<std::string> resources;
+  /**
+   * Whether steam confirmed that we entered the room
+   */
+  bool joined;
+
+private:
+  std::vector<Occupant> occupants;
+
+  MucRoom(const MucRoom&) = delete;
+  MucRoom& operator=(const MucRoom&) = delete;
+  MucRoom& operator=(MucRoom&&) = delete;
+};
+
+#endif /* MUC_ROOM_HPP_INCLUDED */
@@ -3,6 +3,19 @@
 #include <logger/logger.hpp>
 #include <xmpp/jid.hpp>
 #include <utils/scopeguard.hpp>
+#include <profiler/profiler.hpp>
+#include <metrics/metrics.hpp>
+
+#include <algorithm>
+#include <poll.h>
+
+/**
+ * The maximum size of the stanzas queued while the component handshake is
+ * not done
+ */
+static const std::size_t max_queued_before_handshake = 1024 * 1024;
+
+static const char* MUC_USER_X = "http://jabber.org/protocol/muc#user:x";
 
 VaporoComponent::VaporoComponent(std::shared_ptr<Poller> poller,
                                  const std::string& hostname,
@@ -12,7 +25,12 @@ VaporoComponent::VaporoComponent(std::shared_ptr<Poller> poller,
                                  const std::string& steam_password):
   XmppComponent(poller, hostname, secret),
   steam(poller, steam_login, steam_password),
-  authorized_jid(authorized_jid)
+  authorized_jid(authorized_jid),
+  ready(false),
+  available_resources{},
+  batch{},
+  batched_stanzas(0),
+  relayed_message_queued(false)
 {
   this->steam.set_xmpp(this);
   this->stanza_handlers.emplace("presence",
@@ -23,13 +41,26 @@ VaporoComponent::VaporoComponent(std::shared_ptr<Poller> poller,
                                 std::bind(&VaporoComponent::handle_iq, this,std::placeholders::_1));
 }
 
+void VaporoComponent::start_steam()
+{
+  this->steam.start();
+}
+
 void VaporoComponent::handle_presence(const Stanza& stanza)
 {
+  ProfilerScope scope("VaporoComponent::handle_presence");
   const std::string from_str = stanza.get_tag("from");
 
   const Jid from(stanza.get_tag("from"));
 
   const std::string type = stanza.get_tag("type");
+
+  const Jid to(stanza.get_tag("to"));
+  if (!to.resource.empty() && is_chat_room_id(to.local))
+    {
+      this->handle_muc_presence(from_str, to, type);
+      return;
+    }
   if (type == "subscribe")
     { // User wants to add us in its roster
       if (from_str == this->authorized_jid)
@@ -42,19 +73,33 @@ void VaporoComponent::handle_presence(const Stanza& stanza)
           this->send_presence({}, "unsubscribed", {}, from_str, {});
         }
     }
+  else if (from.bare() != this->authorized_jid || !to.local.empty())
+    {
+      // Only the presences of the user to the gateway itself tell whether
+      // they are available, not the directed presences to a contact
+    }
   else if (type == "unavailable")
     {
+      this->available_resources.erase(from_str);
       // TODO log-off from steam
     }
-  else
+  else if (type.empty())
     {
-      // TODO: Log-in to steam
-      this->steam.start();
+      const bool was_available = this->is_user_available();
+      this->available_resources.insert(from_str);
+      if (!this->steam.is_logged_in())
+        {
+          this->steam.send_login_error();
+          this->steam.start();
+        }
+      else if (!was_available)
+        this->steam.send_current_state();
     }
 }
 
 void VaporoComponent::handle_message(const Stanza& stanza)
 {
+  ProfilerScope scope("VaporoComponent::handle_message");
   std::string from = stanza.get_tag("from");
   std::string id = stanza.get_tag("id");
   std::string to_str = stanza.get_tag("to");
@@ -66,13 +111,101 @@ void VaporoComponent::handle_message(const Stanza& stanza)
     type = "normal";
 
   XmlNode* body = stanza.get_child("body", COMPONENT_NS);
+  if (!body || body->get_inner().empty())
+    return;
   Jid to(to_str);
-  if (body && !body->get_inner().empty())
+  if (type == "groupchat")
+    {
+      // Only the authorized user can talk in the steam rooms
+      if (Jid(from).bare() != this->authorized_jid)
+        return;
+      auto it = this->rooms.find(to.local);
+      if (it == this->rooms.end() || !it->second.joined)
+        return;
+      MucRoom& room = it->second;
+      this->steam.send_chat_message(to.local, body->get_inner());
+      // Steam does not send our own messages back, reflect it ourself
+      Stanza message("message");
+      message["from"] = to.local + "@" + this->served_hostname + "/" + room.nick;
+      message["type"] = "groupchat";
+      // The clients recognize their own messages by their id
+      if (!id.empty())
+        message["id"] = id;
+      XmlNode body_node("body");
+      body_node.set_inner(body->get_inner());
+      body_node.close();
+      message.add_child(std::move(body_node));
+      message.close();
+      this->send_to_room_resources(room, message);
+    }
+  else
     this->steam.send_message(to.local, body->get_inner());
 }
 
+void VaporoComponent::handle_muc_presence(const std::string& from, const Jid& to,
+                                          const std::string& type)
+{
+  const std::string& room_id = to.local;
+  if (Jid(from).bare() != this->authorized_jid)
+    {
+      if (type != "unavailable" && type != "error")
+        {
+          this->send_stanza_error("presence", from,
+                                  room_id + "@" + this->served_hostname + "/" + to.resource,
+                                  "", "auth", "forbidden", "");
+        }
+      return;
+    }
+  auto it = this->rooms.find(room_id);
+  if (type == "unavailable")
+    {
+      if (it == this->rooms.end())
+        return;
+      MucRoom& room = it->second;
+      auto resource = std::find(room.resources.begin(), room.resources.end(), from);
+      if (resource == room.resources.end())
+        return;
+      room.resources.erase(resource);
+      Stanza presence = this->make_muc_presence(room_id, room.nick, "unavailable", true);
+      presence["to"] = from;
+      this->send_stanza(presence);
+      if (room.resources.empty())
+        {
+          this->steam.leave_chat(room_id);
+          this->rooms.erase(it);
+        }
+    }
+  else if (type.empty())
+    {
+      if (it == this->rooms.end())
+        {
+          if (!this->steam.is_logged_in())
+            {
+              this->send_stanza_error("presence", from,
+                                      room_id + "@" + this->served_hostname + "/" + to.resource,
+                                      "", "wait", "service-unavailable",
+                                      "Not connected to steam");
+              return;
+            }
+          it = this->rooms.emplace(room_id, MucRoom(to.resource)).first;
+          it->second.resources.push_back(from);
+          this->steam.join_chat(room_id);
+        }
+      else
+        {
+          MucRoom& room = it->second;
+          if (std::find(room.resources.begin(), room.resources.end(), from) != room.resources.end())
+            return;
+          room.resources.push_back(from);
+          if (room.joined)
+            this->send_room_occupants(room_id, room, from);
+        }
+    }
+}
+
 void VaporoComponent::handle_iq(const Stanza& stanza)
 {
+  ProfilerScope scope("VaporoComponent::handle_iq");
   std::string id = stanza.get_tag("id");
   std::string from = stanza.get_tag("from");
   std::string to_str = stanza.get_tag("to");
@@ -113,6 +246,15 @@ void VaporoComponent::send_presence(const std::string& from,
                                     const std::string& status_msg,
                                     const std::string& to,
                                     const std::string& show)
+{
+  this->send_stanza(this->make_presence(from, type, status_msg, to, show));
+}
+
+Stanza VaporoComponent::make_presence(const std::string& from,
+                                      const std::string& type,
+                                      const std::string& status_msg,
+                                      const std::string& to,
+                                      const std::string& show)
 {
   Stanza presence("presence");
   if (from.empty())
@@ -144,12 +286,19 @@ void VaporoComponent::send_presence(const std::string& from,
       presence.add_child(std::move(show_elem));
     }
   presence.close();
-  this->send_stanza(presence);
+  return presence;
 }
 
 void VaporoComponent::send_information_message(const std::string& txt)
+{
+  this->send_chat_message({}, txt);
+}
+
+bool VaporoComponent::send_chat_message(const std::string& from, const std::string& txt)
 {
   Stanza message("message");
+  if (!from.empty())
+    message["from"] = from + "@" + this->served_hostname;
   message["to"] = this->authorized_jid;
   message["type"] = "chat";
   XmlNode body("body");
@@ -157,11 +306,14 @@ void VaporoComponent::send_information_message(const std::string& txt)
   body.close();
   message.add_child(std::move(body));
   message.close();
-  this->send_stanza(message);
+  return this->queue_stanza(message);
 }
 
 void VaporoComponent::after_handshake()
 {
+  Metrics::instance().mark_time("xmpp_handshake_ms");
+  this->ready = true;
+
   // Empty our internal roster
   this->xmpp_roster.clear();
 
@@ -201,6 +353,11 @@ void VaporoComponent::on_steam_roster_item_changed(const RosterItem* item)
 }
 
 void VaporoComponent::send_roster_push(const RosterItem* roster_item)
+{
+  this->send_stanza(this->make_roster_push(roster_item));
+}
+
+Stanza VaporoComponent::make_roster_push(const RosterItem* roster_item)
 {
   Stanza iq("iq");
   iq["to"] = this->authorized_jid;
@@ -218,13 +375,254 @@ void VaporoComponent::send_roster_push(const RosterItem* roster_item)
   query.close();
   iq.add_child(std::move(query));
   iq.close();
-  this->send_stanza(iq);
+  return iq;
 }
 
 void VaporoComponent::send_message_from_steam(const std::string& from, const std::string& body)
 {
-  this->send_message(from, std::make_tuple(body, nullptr), this->authorized_jid,
-                     "chat", false);
+  // Not XmppComponent::send_message(), which would bypass the queue
+  if (this->send_chat_message(from, body))
+    this->relayed_message_queued = true;
+}
+
+void VaporoComponent::send_chat_rooms_list(const std::vector<std::string>& rooms)
+{
+  std::string txt("Steam group chats available:");
+  for (const auto& room: rooms)
+    txt += "\n" + room + "@" + this->served_hostname;
+  this->send_information_message(txt);
+}
+
+Stanza VaporoComponent::make_muc_presence(const std::string& room_id,
+                                          const std::string& nick,
+                                          const std::string& type,
+                                          const bool self,
+                                          const std::string& status_code)
+{
+  Stanza presence("presence");
+  presence["from"] = room_id + "@" + this->served_hostname + "/" + nick;
+  if (!type.empty())
+    presence["type"] = type;
+  XmlNode x(MUC_USER_X);
+  XmlNode item("item");
+  item["affiliation"] = "member";
+  item["role"] = type == "unavailable" ? "none" : "participant";
+  item.close();
+  x.add_child(std::move(item));
+  if (self)
+    {
+      XmlNode status("status");
+      status["code"] = "110";
+      status.close();
+      x.add_child(std::move(status));
+    }
+  if (!status_code.empty())
+    {
+      XmlNode status("status");
+      status["code"] = status_code;
+      status.close();
+      x.add_child(std::move(status));
+    }
+  x.close();
+  presence.add_child(std::move(x));
+  presence.close();
+  return presence;
+}
+
+void VaporoComponent::send_to_room_resources(const MucRoom& room, const Stanza& stanza)
+{
+  if (room.resources.empty())
+    return;
+  const std::string data = stanza.to_string();
+  const std::string& name = stanza.get_name();
+  for (const auto& resource: room.resources)
+    {
+      this->batch += "<";
+      this->batch += name;
+      this->batch += " to='";
+      this->batch += xml_escape(resource);
+      this->batch += "'";
+      // Skip the "<name" already written
+      this->batch.append(data, name.size() + 1, std::string::npos);
+      log_debug("XMPP SENDING to " << resource << ": " << data);
+      ++this->batched_stanzas;
+    }
+}
+
+bool VaporoComponent::wait_for_input(const std::chrono::milliseconds& timeout)
+{
+  if (!this->is_connected() || !this->out_buf.empty() ||
+      !this->steam.only_waits_for_input())
+    return false;
+  struct pollfd fds[2];
+  nfds_t nfds = 0;
+  fds[nfds++] = {this->get_socket(), POLLIN, 0};
+  if (this->steam.is_started())
+    fds[nfds++] = {this->steam.get_socket(), POLLIN, 0};
+  // Interrupted by a signal or not, the Poller takes it from here
+  ::poll(fds, nfds, static_cast<int>(timeout.count()));
+  return true;
+}
+
+void VaporoComponent::send_stanza(const Stanza& stanza)
+{
+  this->queue_stanza(stanza);
+}
+
+bool VaporoComponent::queue_stanza(const Stanza& stanza)
+{
+  const std::string str = stanza.to_string();
+  if (!this->ready && this->batch.size() + str.size() > max_queued_before_handshake)
+    {
+      log_warning("The component handshake is not done and the stanza queue is full, dropping: " << str);
+      Metrics::instance().add("xmpp_stanzas_dropped", 1);
+      return false;
+    }
+  log_debug("XMPP SENDING: " << str);
+  this->batch += str;
+  ++this->batched_stanzas;
+  return true;
+}
+
+void VaporoComponent::send_stanza_error(const std::string& kind, const std::string& to,
+                                        const std::string& from, const std::string& id,
+                                        const std::string& error_type,
+                                        const std::string& defined_condition,
+                                        const std::string& text)
+{
+  this->flush();
+  XmppComponent::send_stanza_error(kind, to, from, id, error_type, defined_condition, text);
+}
+
+void VaporoComponent::flush()
+{
+  // Stanzas produced before the component handshake (for example steam
+  // messages received thanks to steam_eager_login) wait for it
+  if (this->batch.empty() || !this->ready)
+    return;
+  Metrics& metrics = Metrics::instance();
+  metrics.add("xmpp_stanzas_sent", this->batched_stanzas);
+  metrics.add("xmpp_batches_sent", 1);
+  metrics.add("xmpp_bytes_sent", this->batch.size());
+  this->send_data(std::move(this->batch));
+  this->batch.clear();
+  this->batched_stanzas = 0;
+  // Only now, since it may have been held until the handshake
+  if (this->relayed_message_queued)
+    {
+      metrics.mark_time("first_message_relayed_ms");
+      this->relayed_message_queued = false;
+    }
+}
+
+void VaporoComponent::send_room_occupants(const std::string& room_id, const MucRoom& room,
+                                          const std::string& resource)
+{
+  for (const auto& occupant: room.get_occupants())
+    {
+      Stanza presence = this->make_muc_presence(room_id, occupant.nick, {}, false);
+      presence["to"] = resource;
+      this->send_stanza(presence);
+    }
+  Stanza presence = this->make_muc_presence(room_id, room.nick, {}, true);
+  presence["to"] = resource;
+  this->send_stanza(presence);
+}
+
+void VaporoComponent::on_steam_chat_entered(const std::string& room_id,
+                                            std::vector<Occupant>&& occupants)
+{
+  auto it = this->rooms.find(room_id);
+  if (it == this->rooms.end())
+    // All the resources left while we were entering the room, and
+    // handle_muc_presence() already left it
+    return;
+  MucRoom& room = it->second;
+  room.joined = true;
+  room.set_occupants(std::move(occupants));
+  for (const auto& occupant: room.get_occupants())
+    this->send_to_room_resources(room, this->make_muc_presence(room_id, occupant.nick, {}, false));
+  this->send_to_room_resources(room, this->make_muc_presence(room_id, room.nick, {}, true));
+}
+
+void VaporoComponent::on_steam_chat_enter_failed(const std::string& room_id)
+{
+  auto it = this->rooms.find(room_id);
+  if (it == this->rooms.end())
+    return;
+  const MucRoom& room = it->second;
+  for (const auto& resource: room.resources)
+    this->send_stanza_error("presence", resource,
+                            room_id + "@" + this->served_hostname + "/" + room.nick,
+                            "", "cancel", "item-not-found", "Could not enter the steam chat");
+  this->rooms.erase(it);
+}
+
+void VaporoComponent::on_steam_chat_occupant_joined(const std::string& room_id,
+                                                    const std::uint64_t id,
+                                                    const std::string& nick)
+{
+  auto it = this->rooms.find(room_id);
+  if (it == this->rooms.end() || !it->second.joined)
+    return;
+  MucRoom& room = it->second;
+  if (room.add_occupant(id, nick))
+    this->send_to_room_resources(room, this->make_muc_presence(room_id, nick, {}, false));
+}
+
+void VaporoComponent::on_steam_chat_occupant_left(const std::string& room_id,
+                                                  const std::uint64_t id)
+{
+  auto it = this->rooms.find(room_id);
+  if (it == this->rooms.end() || !it->second.joined)
+    return;
+  MucRoom& room = it->second;
+  const std::string nick = room.remove_occupant(id);
+  if (!nick.empty())
+    this->send_to_room_resources(room, this->make_muc_presence(room_id, nick,
+                                                               "unavailable", false));
+}
+
+void VaporoComponent::on_steam_chat_removed(const std::string& room_id,
+                                            const std::string& status_code)
+{
+  auto it = this->rooms.find(room_id);
+  if (it == this->rooms.end())
+    return;
+  const MucRoom& room = it->second;
+  this->send_to_room_resources(room, this->make_muc_presence(room_id, room.nick, "unavailable",
+                                                             true, status_code));
+  this->rooms.erase(it);
+}
+
+void VaporoComponent::send_muc_message_from_steam(const std::string& room_id,
+                                                  const std::uint64_t id,
+                                                  const std::string& body)
+{
+  auto it = this->rooms.find(room_id);
+  if (it == this->rooms.end())
+    return;
+  const MucRoom& room = it->second;
+  const Occupant* occupant = room.find_occupant(id);
+  Stanza message("message");
+  message["from"] = room_id + "@" + this->served_hostname + "/"
+    + (occupant ? occupant->nick : std::to_string(id));
+  message["type"] = "groupchat";
+  XmlNode body_node("body");
+  body_node.set_inner(body);
+  body_node.close();
+  message.add_child(std::move(body_node));
+  message.close();
+  this->send_to_room_resources(room, message);
+  this->relayed_message_queued = true;
+}
+
+void VaporoComponent::on_steam_disconnected()
+{
+  for (const auto& pair: this->rooms)
+    this->send_to_room_resources(pair.second, this->make_muc_presence(pair.first, pair.second.nick,
+                                                                      "unavailable", true));
+  this->rooms.clear();
 }
 
 void VaporoComponent::shutdown()
@@ -236,5 +634,6 @@ void VaporoComponent::shutdown()
       this->send_presence(jid.local, "unavailable", "Gateway shutdown", {}, {});
     }
   this->send_presence({}, "unavailable", "Gateway shutdown", {}, {});
+  this->flush();
 }
 
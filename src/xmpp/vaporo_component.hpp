@@ -3,10 +3,15 @@
 
 #include <xmpp/xmpp_component.hpp>
 #include <xmpp/roster.hpp>
+#include <xmpp/muc_room.hpp>
 #include <steam/steam_client.hpp>
+#include <chrono>
 #include <map>
+#include <set>
+#include <vector>
 
 class Poller;
+class Jid;
 
 class VaporoComponent: public XmppComponent
 {
@@ -19,8 +24,57 @@ public:
                   const std::string& steam_password);
   ~VaporoComponent() = default;
 
+  /**
+   * Start the steam connection and login right away, instead of waiting for
+   * the first available presence of the user.
+   */
+  void start_steam();
+  /**
+   * Whether we received an available presence from the user, meaning that
+   * we can send the presences of the steam contacts.
+   */
+  bool is_user_available() const
+  {
+    return !this->available_resources.empty();
+  }
+
+  /**
+   * If our two sockets are only waiting for incoming data, wait for it
+   * (outside of the Poller) for at most timeout, and return true.  Return
+   * false, without waiting, if one of them may wait for something else
+   * (connection, pending output).  Used to measure the idle time.
+   */
+  bool wait_for_input(const std::chrono::milliseconds& timeout);
+
+  /**
+   * Queue the stanza, to be sent by flush() along with all the others
+   * produced during the same event loop iteration.  This hides the
+   * XmppComponent version, so the stanzas sent by the base class methods
+   * bypass the queue: use the versions below, or flush() before calling
+   * them, to keep the order.
+   */
+  void send_stanza(const Stanza& stanza);
+  /**
+   * Flush the queue, then send the error with the XmppComponent version.
+   */
+  void send_stanza_error(const std::string& kind, const std::string& to,
+                         const std::string& from, const std::string& id,
+                         const std::string& error_type,
+                         const std::string& defined_condition,
+                         const std::string& text);
+  /**
+   * Send all the queued stanzas, in one write.  Called at the end of each
+   * event loop iteration.  Does nothing until the component handshake is
+   * done.
+   */
+  void flush();
+
   void on_steam_roster_item_changed(const RosterItem* item);
   void send_roster_push(const RosterItem* item);
+  /**
+   * Build the roster push sent by send_roster_push(), without sending it.
+   */
+  Stanza make_roster_push(const RosterItem* item);
 
   /**
    * Send a basic presence with a type and an optional status. From contains
@@ -30,6 +84,12 @@ public:
   void send_presence(const std::string& from, const std::string& type,
                      const std::string& status_msg, const std::string& to,
                      const std::string& show);
+  /**
+   * Build the presence sent by send_presence(), without sending it.
+   */
+  Stanza make_presence(const std::string& from, const std::string& type,
+                       const std::string& status_msg, const std::string& to,
+                       const std::string& show);
   void send_message_from_steam(const std::string& from, const std::string& body);
   /**
    * Send a simple message from the gateway itself, to indicate an error, or
@@ -39,21 +99,87 @@ public:
 
   void on_roster_items_received(const XmlNode* node);
 
+  /**
+   * Tell the user which chat rooms are available, one for each steam group
+   * we are member of.
+   */
+  void send_chat_rooms_list(const std::vector<std::string>& rooms);
+  /**
+   * Called by the steam client on the events of the chat rooms we joined
+   */
+  void on_steam_chat_entered(const std::string& room_id, std::vector<Occupant>&& occupants);
+  void on_steam_chat_enter_failed(const std::string& room_id);
+  void on_steam_chat_occupant_joined(const std::string& room_id, const std::uint64_t id,
+                                     const std::string& nick);
+  void on_steam_chat_occupant_left(const std::string& room_id, const std::uint64_t id);
+  /**
+   * We have been removed from the room by steam (kicked, banned,
+   * disconnected).  The status code tells the user why, if not empty.
+   */
+  void on_steam_chat_removed(const std::string& room_id, const std::string& status_code);
+  void send_muc_message_from_steam(const std::string& room_id, const std::uint64_t id,
+                                   const std::string& body);
+  void on_steam_disconnected();
+
   /**
    * Handle the various stanza types
    */
   void handle_presence(const Stanza& stanza);
   void handle_message(const Stanza& stanza);
   void handle_iq(const Stanza& stanza);
+  /**
+   * Handle a presence sent to a room@hostname/nick JID, where room is the
+   * id of a steam chat room.
+   */
+  void handle_muc_presence(const std::string& from, const Jid& to,
+                           const std::string& type);
 
   void after_handshake() override final;
 
   void shutdown();
 
 private:
+  /**
+   * Queue the stanza, and return whether it was.  It's dropped if the queue
+   * is full while waiting for the component handshake.
+   */
+  bool queue_stanza(const Stanza& stanza);
+  /**
+   * Queue a chat message to the user, from the given steam contact, or from
+   * the gateway itself if from is empty.  Returns whether it was queued.
+   */
+  bool send_chat_message(const std::string& from, const std::string& txt);
+  /**
+   * Build a presence of an occupant of the room, without a "to", to be sent
+   * with send_to_room_resources().
+   */
+  Stanza make_muc_presence(const std::string& room_id, const std::string& nick,
+                           const std::string& type, const bool self,
+                           const std::string& status_code={});
+  /**
+   * Serialize the stanza (which has no "to") once, and queue it for each
+   * resource of the user that joined the room, only inserting the "to"
+   * attribute in front of the shared serialized data.
+   */
+  void send_to_room_resources(const MucRoom& room, const Stanza& stanza);
+  /**
+   * Send the presences of all the occupants, and then ours, to a resource
+   * that just joined the room.
+   */
+  void send_room_occupants(const std::string& room_id, const MucRoom& room,
+                           const std::string& resource);
+
   SteamClient steam;
 
   std::string authorized_jid;
+  /**
+   * Whether the component handshake is done
+   */
+  bool ready;
+  /**
+   * The full JIDs of the available resources of the authorized user
+   */
+  std::set<std::string> available_resources;
   /**
    * A roster containing the information we get from the XMPP server.
    */
@@ -64,6 +190,20 @@ private:
    * remove these differences.
    */
   Roster steam_roster;
+  /**
+   * The steam chat rooms joined by the user, by room id
+   */
+  std::map<std::string, MucRoom> rooms;
+  /**
+   * The serialized stanzas waiting for the next flush()
+   */
+  std::string batch;
+  std::size_t batched_stanzas;
+  /**
+   * Whether the queue contains a message relayed from steam, to measure
+   * the time of the first one actually sent
+   */
+  bool relayed_message_queued;
 
   VaporoComponent(const VaporoComponent&) = delete;
   VaporoComponent(VaporoComponent&&) = delete;